@@ -1,15 +1,21 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdbool.h>
 
 char*			filename;
 unsigned char*	bytStr;
+unsigned char*	tile_banks;
+unsigned char	sub_pal_remap[16][256];
 enum 			SourceFormat sourceFormat;
 enum 			TargetFormat targetFormat;
 FILE			*source_file, *tilefile1, *tilefile2, *tilemapfile, *palfile;
-long			file_size,tx,tile_x;
-int				colNum,pix_loc,img_width,img_height,ty,tile_y;
-short			pal_loc,img_depth,tile_depth,tile_size,coef,pix0,pix1;
-bool			full_size,ref,isTileMap;
+long			file_size,hdr_size,seg_first,seg_length,seg_stride,seg_count,tx,tile_x,tile_x0,tiles_x,src_tiles_x,tiles_start,tiles_count;
+int				colNum,pix_loc,img_width,img_height,ty,tile_y,tile_y0,rect_x,rect_y,rect_w,rect_h;
+short			pal_loc,img_depth,tile_depth,tile_size,coef,pix0,pix1,tiles_y;
+bool			full_size,ref,isTileMap,sub_palettes,isRect,isTileRange;
 
 enum SourceFormat
 {
@@ -55,6 +61,18 @@ struct ArgsInfo
  const char* description;
 };
 
+//Single zero-initialized block for all the per-conversion buffers
+struct Arena
+{
+ unsigned char*	base;
+ size_t			size,used;
+};
+
+struct Arena	arena;
+
+//Blocks are 8-byte aligned, so the arena size should be counted with ARENA_BLOCK()
+#define ARENA_BLOCK(size)	(((size_t)(size)+7)&~(size_t)7)
+
 const struct FormatInfo source_formats[] = {
     {"bmp", "standard BMP file"},
     {"rohga_decr", "decrypted 4bpp planar 8x8 tiles for Armored Force Rohga"},
@@ -75,15 +93,17 @@ const struct TargetInfo target_formats[] = {
     {"model3_8", "8bpp linear 8x8 tiles for Sega Model 3 tilemaps"},
     {"neogeo_spr", "4bpp planar 16x16 sprites for Neo-Geo MVS\\AES"},
     {"psikyo_later_generations_8", "8bpp linear 16x16 tiles for Psikyo's SH-2 based arcade machines"},
-    {"atetris", "4bpp linear 8x8 tiles for Atari's Tetris arcade hardware (identical to Sega Genesis/Mega Drive and MSX tiles)"},
-    {"tc0180vcu", "4bpp planar tiles for Taito TC0180VCU custom video chip, used mainly by Taito System B arcade platform. Can be output both in 8x8 and 16x16 (using a -full arg) form. Generated palette data is 12-bit RGBx."},
+    {"atetris", "4bpp linear 8x8 tiles for Atari's Tetris arcade hardware (identical to Sega Genesis/Mega Drive and MSX tiles). Accepts 8bpp BMPs with -tm."},
+    {"tc0180vcu", "4bpp planar tiles for Taito TC0180VCU custom video chip, used mainly by Taito System B arcade platform. Can be output both in 8x8 and 16x16 (using a -full arg) form. Generated palette data is 12-bit RGBx. Accepts 8bpp BMPs with -tm."},
     {NULL, NULL}
 };
 
 const struct ArgsInfo additional_args[] = {
-    {"tm", "generate tilemap (only for BMP images and non-8x8 tile formats)"},
+    {"tm", "generate tilemap (only for BMP images and non-8x8 tile formats). For 8bpp images converted to 4bpp targets the upper byte of each entry holds the tile's sub-palette bank instead of the index bits 24-31 (required for such a conversion)."},
     {"full", "use a larger version of some tile formats (only for planar4_16x16 source and old_sprite and tc0180vcu targets)"},
     {"ref", "Reflect an input or output (depends on the source and target formats combination) tiles. This feature is used by taito_z (horizontal) and tc0180vcu (vertical, as a target exclusively) only."},
+    {"rect x,y,w,h", "convert only the given pixel rectangle of a BMP image (must be aligned to the target tile size)"},
+    {"tiles start,count", "convert only the given range of tiles of a non-BMP source"},
     {"h, --help", "show this help message"},
     {NULL, NULL}
 };
@@ -188,6 +208,24 @@ void process_arguments(int argc,char* argv[])
   else if(strcmp(argv[i],"-tm")==0)		isTileMap=true;
   else if(strcmp(argv[i],"-full")==0)	full_size=true;
   else if(strcmp(argv[i],"-ref")==0)	ref=true;
+  else if(strcmp(argv[i],"-rect")==0&&i+1<argc)
+  {
+   if(sscanf(argv[++i],"%d,%d,%d,%d",&rect_x,&rect_y,&rect_w,&rect_h)!=4||rect_x<0||rect_y<0||rect_w<=0||rect_h<=0)
+   {
+    printf("Wrong rectangle: %s\n",argv[i]);
+    exit(1);
+   }
+   isRect=true;
+  }
+  else if(strcmp(argv[i],"-tiles")==0&&i+1<argc)
+  {
+   if(sscanf(argv[++i],"%ld,%ld",&tiles_start,&tiles_count)!=2||tiles_start<0||tiles_count<=0)
+   {
+    printf("Wrong tiles range: %s\n",argv[i]);
+    exit(1);
+   }
+   isTileRange=true;
+  }
   else if(i==1)							filename=argv[i];
   else
   {
@@ -207,6 +245,13 @@ void check_format()
  {
   case FORMAT_BMP:
   	   extension=".bmp";
+  	   if(file_size<54)
+  	   {
+       	printf("The file is broken!\n");
+       	fclose(source_file);
+  	   	exit(1);
+	   }
+
   	   if(bytStr[0]!='B'||bytStr[1]!='M')
   	   {
        	printf("BMP file signature isn't found!\n");
@@ -260,44 +305,266 @@ void check_format()
  if(img_depth<=8) coef=8/img_depth;
 }
 
-int get_tile_el_value(short x,short y)
+//Position of the source file byte in bytStr: the header goes first, then the loaded segments one after another
+long src_index(long offset)
+{
+ if(seg_count==1) return hdr_size+offset-seg_first;
+
+ return hdr_size+((offset-seg_first)/seg_stride)*seg_length+(offset-seg_first)%seg_stride;
+}
+
+//Raw 8bpp BMP pixel of the current tile
+int get_bmp_pixel(short x,short y)
 {
- if(sourceFormat==FORMAT_BMP)					return bytStr[file_size-(((tile_y*tile_size+y)*img_width)/coef+((img_width-tile_x*tile_size)/coef-x))];
- else if(sourceFormat==FORMAT_ROHGA_DECR)		return bytStr[(file_size/2)*((x%4)/2)+tile_x*16+(x%2)+y*2];
- else if(sourceFormat==FORMAT_PCE_CG)			return bytStr[16*((x%4)/2)+tile_x*32+(x%2)+y*2];
- else if(sourceFormat==FORMAT_PLANAR4_16x16)	return bytStr[(targetFormat==TARGET_NEOGEO_SPR?tile_x:tile_x/4)*128+(full_size==true?(x%2):(((targetFormat==TARGET_NEOGEO_SPR?x:tile_x)%2)*64+(((targetFormat==TARGET_NEOGEO_SPR?x:tile_x)%4)/2)*32))+(targetFormat==TARGET_NEOGEO_SPR?(x/2)*2:x)+((y*4)<<full_size)];
- else if(sourceFormat==FORMAT_NEO_MIRROR)		return bytStr[tile_x*128+((x/4)%2)*64+(x%4)+(y*4)];
- else if(sourceFormat==FORMAT_OLD_SPRITE)		return bytStr[(tile_x/16)*1024+(tile_x%4)*8+((tile_x%16)/4)*256+(x/4)*4+x/2+y*32];
- else if(sourceFormat==FORMAT_TAITO_Z)			return bytStr[(targetFormat==TARGET_NEOGEO_SPR?tile_x:tile_x/2)*64+(ref==true?1-((targetFormat==TARGET_NEOGEO_SPR?x:tile_x)%2):(targetFormat==TARGET_NEOGEO_SPR?x:tile_x)%2)+(3-x)*2+y*8];
- else if(sourceFormat==FORMAT_UNDERFIRE)		return bytStr[(tile_x/4)*160+(1-(tile_x%2))*5+((tile_x%4)/2)*80+x+y*10];
- else if(sourceFormat==FORMAT_HALF_DEPTH)		return bytStr[((tile_x%(file_size/tile_size*tile_depth/2))/4)*256+(tile_x%2)*8+((tile_x%4)/2)*128+x+y*16];
+ return bytStr[src_index(file_size-((tile_y*tile_size+y)*img_width+(img_width-tile_x*tile_size-x)))];
+}
+
+//Source file offset of the tile element, regardless of which part of the file is loaded
+long get_tile_el_offset(short x,short y)
+{
+ if(sourceFormat==FORMAT_BMP)					return file_size-(((tile_y*tile_size+y)*img_width)/coef+((img_width-tile_x*tile_size)/coef-x));
+ else if(sourceFormat==FORMAT_ROHGA_DECR)		return (file_size/2)*((x%4)/2)+tile_x*16+(x%2)+y*2;
+ else if(sourceFormat==FORMAT_PCE_CG)			return 16*((x%4)/2)+tile_x*32+(x%2)+y*2;
+ else if(sourceFormat==FORMAT_PLANAR4_16x16)	return (targetFormat==TARGET_NEOGEO_SPR?tile_x:tile_x/4)*128+(full_size==true?(x%2):(((targetFormat==TARGET_NEOGEO_SPR?x:tile_x)%2)*64+(((targetFormat==TARGET_NEOGEO_SPR?x:tile_x)%4)/2)*32))+(targetFormat==TARGET_NEOGEO_SPR?(x/2)*2:x)+((y*4)<<full_size);
+ else if(sourceFormat==FORMAT_NEO_MIRROR)		return tile_x*128+((x/4)%2)*64+(x%4)+(y*4);
+ else if(sourceFormat==FORMAT_OLD_SPRITE)		return (tile_x/16)*1024+(tile_x%4)*8+((tile_x%16)/4)*256+(x/4)*4+x/2+y*32;
+ else if(sourceFormat==FORMAT_TAITO_Z)			return (targetFormat==TARGET_NEOGEO_SPR?tile_x:tile_x/2)*64+(ref==true?1-((targetFormat==TARGET_NEOGEO_SPR?x:tile_x)%2):(targetFormat==TARGET_NEOGEO_SPR?x:tile_x)%2)+(3-x)*2+y*8;
+ else if(sourceFormat==FORMAT_UNDERFIRE)		return (tile_x/4)*160+(1-(tile_x%2))*5+((tile_x%4)/2)*80+x+y*10;
+ else if(sourceFormat==FORMAT_HALF_DEPTH)		return ((tile_x%(file_size*8/(tile_size*tile_size*tile_depth)/2))/4)*256+(tile_x%2)*8+((tile_x%4)/2)*128+x+y*16;
 
  return 0;
 }
 
-bool tiles_match(long prev_tx,int prev_ty)
+//Number of elements per row the encoders address in a raw source tile
+short tile_el_width()
+{
+ if(sourceFormat==FORMAT_OLD_SPRITE||sourceFormat==FORMAT_HALF_DEPTH)	return tile_size;
+
+ return (tile_size/8-1)*4+tile_depth; //planar ones are addressed by (x/8)*4+plane
+}
+
+int get_tile_el_value(short x,short y)
+{
+ if(sourceFormat==FORMAT_BMP&&sub_palettes)	return (sub_pal_remap[tile_banks[(tile_y-tile_y0)*tiles_x+tile_x-tile_x0]][get_bmp_pixel(x*2,y)]<<4)|sub_pal_remap[tile_banks[(tile_y-tile_y0)*tiles_x+tile_x-tile_x0]][get_bmp_pixel(x*2+1,y)];
+
+ return bytStr[src_index(get_tile_el_offset(x,y))];
+}
+
+//Packs the elements compared by the duplicates search of every tile one after another, so tiles are compared as a plain memory blocks
+void pack_tiles(uint8_t* packed)
 {
- short x,y;
+ long	tile_num;
+ short	x,y;
 
- //Check against previous tiles for duplicates
- for(y=0;y<tile_size;y++)
+ for(tile_num=0;tile_num<tiles_x*tiles_y;tile_num++)
  {
-  for(x=0;x<(sourceFormat<FORMAT_ROHGA_DECR?tile_size/coef:tile_depth);x++)
+  tile_x=tile_x0+tile_num%tiles_x;
+  tile_y=tile_y0+tile_num/tiles_x;
+
+  for(y=0;y<tile_size;y++)
   {
-   tile_x=tx;
-   tile_y=ty;
+   for(x=0;x<(sourceFormat<FORMAT_ROHGA_DECR?tile_size/coef:tile_el_width());x++)
+   {
+	*packed=get_tile_el_value(x,y);
+
+	//The second half of half_depth tiles re-reads the first one for its low nibbles
+	if(sourceFormat==FORMAT_HALF_DEPTH&&tile_x>=src_tiles_x/2) *packed&=0xf;
+	packed++;
+   }
+  }
+ }
+}
 
-   short tile_el1=get_tile_el_value(x,y);
+void arena_init(size_t size)
+{
+ arena.base=(unsigned char*)calloc(size>0?size:1,1);
+ if(arena.base==NULL)
+ {
+  printf("Memory allocation failed (at the buffers allocation stage)\n");
+  fclose(source_file);
+  exit(1);
+ }
+ arena.size=size;
+ arena.used=0;
+}
 
-   tile_x=prev_tx;
-   tile_y=prev_ty;
+void* arena_alloc(size_t size)
+{
+ void* block=arena.base+arena.used;
 
-   short tile_el2=get_tile_el_value(x,y);
+ if(ARENA_BLOCK(size)>arena.size-arena.used)
+ {
+  printf("Memory allocation failed (arena is exhausted)\n");
+  fclose(source_file);
+  exit(1);
+ }
+
+ arena.used+=ARENA_BLOCK(size);
+ return block;
+}
+
+/*
+ *	8bpp images for 4bpp targets are treated as a 16 banks of 16 colours each.
+ *	Every tile gets the bank which represents its pixels with the smallest
+ *	colour error, and then its pixels are remapped into that bank. Colour 0
+ *	of each bank is considered as a transparent one.
+ */
+void assign_sub_palettes()
+{
+ long	tiles_num=tiles_x*tiles_y,tile_num,cost,best_cost;
+ int	bank,col,i,dist,best_dist,used_num,used[256],counts[256];
+ int	sub_pal_dist[16][256];
+ short	x,y,best_bank;
 
-   if(tile_el1!=tile_el2) return false;
+ //Nearest colour of each bank for every source colour
+ for(bank=0;bank<16;bank++)
+ {
+  for(col=0;col<256;col++)
+  {
+   if((col&0xf)==0||(col>>4)==bank)
+   {
+    sub_pal_remap[bank][col]=col&0xf;
+    sub_pal_dist[bank][col]=0;
+    continue;
+   }
+
+   best_dist=-1;
+   for(i=1;i<16;i++)
+   {
+	dist=(bytStr[pal_loc+col*4]-bytStr[pal_loc+(bank*16+i)*4])*(bytStr[pal_loc+col*4]-bytStr[pal_loc+(bank*16+i)*4])
+		+(bytStr[pal_loc+col*4+1]-bytStr[pal_loc+(bank*16+i)*4+1])*(bytStr[pal_loc+col*4+1]-bytStr[pal_loc+(bank*16+i)*4+1])
+		+(bytStr[pal_loc+col*4+2]-bytStr[pal_loc+(bank*16+i)*4+2])*(bytStr[pal_loc+col*4+2]-bytStr[pal_loc+(bank*16+i)*4+2]);
+
+	if(best_dist<0||dist<best_dist)
+	{
+	 best_dist=dist;
+	 sub_pal_remap[bank][col]=i;
+	}
+   }
+   sub_pal_dist[bank][col]=best_dist;
   }
  }
- return true;
+
+ tile_banks=(unsigned char*)arena_alloc(tiles_num);
+
+ for(tile_num=0;tile_num<tiles_num;tile_num++)
+ {
+  tile_x=tile_x0+tile_num%tiles_x;
+  tile_y=tile_y0+tile_num/tiles_x;
+
+  //Colours histogram of the tile
+  memset(counts,0,sizeof(counts));
+  used_num=0;
+  for(y=0;y<tile_size;y++)
+  {
+   for(x=0;x<tile_size;x++)
+   {
+	col=get_bmp_pixel(x,y);
+	if(counts[col]++==0) used[used_num++]=col;
+   }
+  }
+
+  best_bank=0;
+  best_cost=-1;
+  for(bank=0;bank<16;bank++)
+  {
+   cost=0;
+   for(i=0;i<used_num;i++) cost+=(long)counts[used[i]]*sub_pal_dist[bank][used[i]];
+
+   if(best_cost<0||cost<best_cost)
+   {
+	best_cost=cost;
+	best_bank=bank;
+   }
+  }
+  tile_banks[tile_num]=best_bank;
+
+  if(best_cost>0) printf("Tile %ld,%d mixes palette banks, its colours are remapped to the nearest ones of bank %d.\n",tile_x,tile_y,best_bank);
+ }
+}
+
+/*
+ *	Finds the part of the source file which is addressed by the tiles being
+ *	converted. It's loaded as seg_count segments of seg_length bytes, placed
+ *	seg_stride bytes apart in the file, right after the file header.
+ */
+void find_source_segments()
+{
+ long	offset,seg_last,row_bytes=(long)img_width*img_depth/8;
+ short	x,y;
+
+ seg_first=hdr_size;
+ seg_length=seg_stride=file_size-hdr_size;
+ seg_count=1;
+
+ if(isRect)
+ {
+  //BMP rows are stored bottom-up, so each row of the region is read separately starting from the lowest one
+  seg_count=tiles_y*tile_size;
+  seg_length=(long)tiles_x*tile_size*img_depth/8;
+  seg_stride=row_bytes;
+  seg_first=file_size-(tile_y0*tile_size+seg_count)*row_bytes+(long)tile_x0*tile_size*img_depth/8;
+ }
+ else if(sourceFormat>=FORMAT_ROHGA_DECR)
+ {
+  /*
+   *	Raw tile layouts may reach a bit outside the tiles they belong to (and
+   *	so outside the file), so the span is taken from the addressed elements
+   *	themselves even for a whole file. Bytes outside the file are left
+   *	zeroed by the arena.
+   *
+   *	Rohga planes lie in the two file halves, so the same span is read
+   *	from both of them.
+   */
+  if(sourceFormat==FORMAT_ROHGA_DECR)
+  {
+   seg_count=2;
+   seg_stride=file_size/2;
+  }
+
+  seg_first=LONG_MAX;
+  seg_last=LONG_MIN;
+  for(tile_x=tile_x0;tile_x<tile_x0+tiles_x;tile_x++)
+  {
+   for(y=0;y<tile_size;y++)
+   {
+	for(x=0;x<tile_el_width();x++)
+	{
+	 offset=get_tile_el_offset(x,y);
+	 if(seg_count>1) offset%=seg_stride;
+
+	 if(offset<seg_first)	seg_first=offset;
+	 if(offset>seg_last)	seg_last=offset;
+	}
+   }
+  }
+
+  seg_length=seg_last<seg_first?0:seg_last+1-seg_first;
+  if(seg_count==1) seg_stride=seg_length;
+ }
+}
+
+//The header read at the format check stage is replaced by the arena copy
+void read_source_data()
+{
+ long i,start,skip;
+
+ free(bytStr);
+ bytStr=(unsigned char*)arena_alloc(hdr_size+seg_count*seg_length);
+
+ fseek(source_file,0L,SEEK_SET);
+ fread(bytStr,1,hdr_size,source_file);
+
+ //Segment parts before the file start (and after its end) stay zeroed
+ for(i=0;i<seg_count;i++)
+ {
+  start=seg_first+i*seg_stride;
+  skip=start<0?-start:0;
+  if(skip>=seg_length) continue;
+
+  fseek(source_file,start+skip,SEEK_SET);
+  fread(bytStr+hdr_size+i*seg_length+skip,1,seg_length-skip,source_file);
+ }
 }
 
 //Standart colour spaces
@@ -444,7 +711,10 @@ int main(int argc,char *argv[])
 
  fseek(source_file,0L,SEEK_SET);
 
- bytStr=(unsigned char*)malloc(file_size);
+ //Only the header is loaded for now, the tile data itself is read when the converted region is known
+ hdr_size=sourceFormat==FORMAT_BMP?(file_size<54?file_size:54):0;
+
+ bytStr=(unsigned char*)malloc(hdr_size+1);
  if(bytStr==NULL)
  {
   printf("Memory allocation failed (at the format check stage)\n");
@@ -452,7 +722,7 @@ int main(int argc,char *argv[])
   exit(1);
  }
 
- fread(bytStr,1,file_size,source_file);
+ fread(bytStr,1,hdr_size,source_file);
 
  //Process based on target format
  if(full_size==true&&!(sourceFormat==FORMAT_PLANAR4_16x16||targetFormat==TARGET_OLD_SPRITE||targetFormat==TARGET_TC0180VCU))
@@ -481,9 +751,6 @@ int main(int argc,char *argv[])
  if(targetFormat==TARGET_NEOGEO_SPR||targetFormat>TARGET_PSIKYO_LATER_GENERATIONS_8)			depth=4;
  else																							depth=8;
 
- long	tiles_x;
- short	tiles_y;
-
  if((targetFormat==TARGET_MODEL3_8&&!(sourceFormat<=FORMAT_ROHGA_DECR||sourceFormat==FORMAT_PCE_CG||(sourceFormat==FORMAT_PLANAR4_16x16&&full_size==false)||sourceFormat==FORMAT_OLD_SPRITE||sourceFormat==FORMAT_TAITO_Z||sourceFormat==FORMAT_UNDERFIRE||sourceFormat==FORMAT_HALF_DEPTH))
 	 ||(targetFormat==TARGET_NEOGEO_SPR&&!(sourceFormat==FORMAT_PLANAR4_16x16||sourceFormat==FORMAT_NEO_MIRROR||sourceFormat==FORMAT_TAITO_Z))
 	 ||!(targetFormat==TARGET_NEOGEO_SPR||targetFormat==TARGET_MODEL3_8)&&sourceFormat>=FORMAT_ROHGA_DECR)
@@ -511,7 +778,20 @@ int main(int argc,char *argv[])
    exit(1);
   }
 
-  if(img_depth!=depth)
+  //8bpp images gets split to a 16-colour sub-palettes for 4bpp targets
+  if(img_depth==8&&depth==4)
+  {
+   if(!isTileMap)
+   {
+    printf("8bpp images need a tilemap (-tm arg) to keep the palette banks for a %d-bit target.\n",depth);
+    fclose(source_file);
+    exit(1);
+   }
+
+   sub_palettes=true;
+   coef=2;
+  }
+  else if(img_depth!=depth)
   {
    printf("Chosen format uses a %d-bit pixels.\n",depth);
    fclose(source_file);
@@ -520,6 +800,7 @@ int main(int argc,char *argv[])
 
   tiles_x=img_width/tile_size;
   tiles_y=img_height/tile_size;
+  hdr_size=pal_loc+(4<<img_depth);
  }
  else
  {
@@ -540,11 +821,82 @@ int main(int argc,char *argv[])
   tiles_y=1; //Because a tile data, unlike the standart GFX files, hasn't a size parameters by themselves, it'd be a more expedient to present all the data piece as a very-very long tiles row
  }
 
+ src_tiles_x=tiles_x;
+
+ //Narrow the conversion down to the requested region
+ if(isRect)
+ {
+  if(sourceFormat>=FORMAT_ROHGA_DECR)
+  {
+   printf("Rectangle can be set for BMP images only, use a tiles range instead.\n");
+   fclose(source_file);
+   exit(1);
+  }
+
+  if(rect_x%tile_size!=0||rect_y%tile_size!=0||rect_w%tile_size!=0||rect_h%tile_size!=0
+	 ||rect_x>=img_width||rect_w>img_width-rect_x||rect_y>=img_height||rect_h>img_height-rect_y)
+  {
+   printf("Rectangle should fit the image and be aligned to %d pixels!\n",tile_size);
+   fclose(source_file);
+   exit(1);
+  }
+
+  tile_x0=rect_x/tile_size;
+  tile_y0=rect_y/tile_size;
+  tiles_x=rect_w/tile_size;
+  tiles_y=rect_h/tile_size;
+ }
+
+ if(isTileRange)
+ {
+  if(sourceFormat<FORMAT_ROHGA_DECR)
+  {
+   printf("Tiles range can be set for raw tile formats only, use a rectangle instead.\n");
+   fclose(source_file);
+   exit(1);
+  }
+
+  if(tiles_start>=tiles_x||tiles_count>tiles_x-tiles_start)
+  {
+   printf("Source contains only %ld tiles!\n",tiles_x);
+   fclose(source_file);
+   exit(1);
+  }
+
+  tile_x0=tiles_start;
+  tiles_x=tiles_count;
+ }
+
+ find_source_segments();
+
+ /*
+  *	Sprite targets are staged tile by tile in the output order (a single
+  *	hardware tile of old_sprite is always 32x32, even if only its quarter
+  *	is used), other targets are written to the file directly. Tilemaps
+  *	also get every tile packed for the duplicates search.
+  */
+ size_t	source_size=hdr_size+seg_count*seg_length;
+ size_t	tile_bytes=targetFormat==TARGET_OLD_SPRITE?1024:tile_size*tile_size*depth/8;
+ size_t	staged_size=(targetFormat==TARGET_OLD_SPRITE||targetFormat==TARGET_NEOGEO_SPR)?tiles_x*tiles_y*tile_bytes:0;
+ size_t	banks_size=sub_palettes?tiles_x*tiles_y:0;
+ size_t	base_size=isTileMap?tiles_x*tiles_y*sizeof(uint32_t):0;
+ size_t	packed_tile=tile_size*(sourceFormat<FORMAT_ROHGA_DECR?tile_size/coef:tile_el_width());
+ size_t	packed_size=isTileMap?tiles_x*tiles_y*packed_tile:0;
+
+ arena_init(ARENA_BLOCK(source_size)+ARENA_BLOCK(banks_size)+ARENA_BLOCK(base_size)+ARENA_BLOCK(staged_size)+ARENA_BLOCK(packed_size));
+ read_source_data();
+
+ if(sub_palettes) assign_sub_palettes();
+
  //Process tiles
- long	unique_tiles_base[tiles_x*tiles_y],tile_index,prev_tx,matched_tx,unique_tiles=0;
- int	prev_ty,matched_ty;
- short	tiles[sourceFormat<FORMAT_ROHGA_DECR?img_width*img_height:tile_size*tile_size*depth/8],x,y,z;
- bool	match_found;
+ uint32_t*	unique_tiles_base=(uint32_t*)arena_alloc(base_size);
+ uint8_t*	tiles=(uint8_t*)arena_alloc(staged_size);
+ uint8_t*	packed=(uint8_t*)arena_alloc(packed_size);
+ long		tile_index,unique_tiles=0;
+ short		x,y,z;
+ bool		match_found;
+
+ if(isTileMap) pack_tiles(packed);
 
  for(ty=0;ty<tiles_y;ty++)
  {
@@ -553,27 +905,19 @@ int main(int argc,char *argv[])
    match_found=false;
    if(isTileMap)
    {
-   	//Check against previous tiles for duplicates
-	for(prev_ty=0;prev_ty<=ty&&!match_found;prev_ty++)
+   	//Check against previous unique tiles for duplicates (the first matching previous tile is always a unique one)
+	for(tile_index=0;(tx>0||ty>0)&&tile_index<=unique_tiles;tile_index++)
 	{
-	 for(prev_tx=0;prev_tx<(prev_ty==ty?tx:tiles_x)&&!match_found;prev_tx++)
+	 if(memcmp(packed+(ty*tiles_x+tx)*packed_tile,packed+unique_tiles_base[tile_index]*packed_tile,packed_tile)==0)
 	 {
-	  if(tiles_match(prev_tx,prev_ty))
-	  {
-	   match_found=true;
-	   matched_tx=prev_tx;
-	   matched_ty=prev_ty;
-	  }
+	  match_found=true;
+	  break;
 	 }
-    }
+	}
 
 	if(match_found)
 	{
-	 for(tile_index=0;tile_index<unique_tiles;tile_index++)
-	 {
-	  if(unique_tiles_base[tile_index]==matched_ty*tiles_x+matched_tx) break;
-     }
-	 fputc((tile_index>>24)&0xff,tilemapfile);
+	 fputc(sub_palettes?tile_banks[ty*tiles_x+tx]:(tile_index>>24)&0xff,tilemapfile);
 	 fputc((tile_index>>16)&0xff,tilemapfile);
 	 fputc((tile_index>>8)&0xff,tilemapfile);
 	 fputc(tile_index&0xff,tilemapfile);
@@ -582,7 +926,7 @@ int main(int argc,char *argv[])
 	{
 	 if(tx>0||ty>0)	unique_tiles++;
 	 unique_tiles_base[unique_tiles]=ty*tiles_x+tx;
-	 fputc((unique_tiles>>24)&0xff,tilemapfile);
+	 fputc(sub_palettes?tile_banks[ty*tiles_x+tx]:(unique_tiles>>24)&0xff,tilemapfile);
 	 fputc((unique_tiles>>16)&0xff,tilemapfile);
 	 fputc((unique_tiles>>8)&0xff,tilemapfile);
 	 fputc(unique_tiles&0xff,tilemapfile);
@@ -591,8 +935,8 @@ int main(int argc,char *argv[])
 
    if(!match_found)
    {
-   	tile_x=tx;
-	tile_y=ty;
+   	tile_x=tile_x0+tx;
+	tile_y=tile_y0+ty;
 
 	for(y=0;y<tile_size;y++)
  	{
@@ -604,7 +948,8 @@ int main(int argc,char *argv[])
 
        if(sourceFormat<FORMAT_ROHGA_DECR||sourceFormat==FORMAT_HALF_DEPTH)
 	   {
-        if(tx<tiles_x/2)	pix0>>4;
+        //The high nibble shift is a no-op on purpose: the encoders below go on from this pix0, so fixing it would change their output
+        if(tile_x<src_tiles_x/2)	pix0>>4;
         else				pix0&=0xf;
 	   }
 	  }
@@ -616,21 +961,17 @@ int main(int argc,char *argv[])
         else								pix0|=(((get_tile_el_value((x/8)*4+z,y))&(1<<(7-(x%8))))>>(7-(x%8)))<<(x%8);
 	   }
       }
-
-      if(targetFormat==TARGET_OLD_SPRITE)		tiles[(full_size==true?tile_x:tile_x/4)*128+...]=pix0;
-      else if(targetFormat==TARGET_TC0180VCU)	tiles[(full_size==true?tile_x:tile_x/4)*128+...]=pix0;
-      else										tiles[tile_size*tile_size*depth/8+y*(tile_size*depth/8)+(targetFormat==TARGET_MODEL3_8?(x/4)*4+(3-(x%4)):x)]=pix0; //linear target formats
 	 }
 	 if(sourceFormat<FORMAT_ROHGA_DECR)
 	 {
 	  if(targetFormat==TARGET_TC0180VCU)
 	  {
-	   for(z=0;z<img_depth;z++)
+	   for(z=0;z<depth;z++)
 	   {
 	   	for(x=0;x<tile_size/coef;x++)
 	   	{
-	   	 pix0|=((get_tile_el_value(x,(ref==true?tile_size-y:y))>>4)&(1<<z)>>z)<<(7-(x%8)*2);
-		 pix1|=((get_tile_el_value(x,(ref==true?tile_size-y:y))&0xf)&(1<<z)>>z)<<(7-(x%8)*2+1);
+	   	 pix0|=((get_tile_el_value(x,(ref==true?tile_size-1-y:y))>>4)&(1<<z)>>z)<<(7-(x%8)*2);
+		 pix1|=((get_tile_el_value(x,(ref==true?tile_size-1-y:y))&0xf)&(1<<z)>>z)<<(7-(x%8)*2+1);
 
 		 if(full_size==true&&x==tile_size/coef/2)
 		 {
@@ -656,7 +997,7 @@ int main(int argc,char *argv[])
 	   	{
 		 if(targetFormat==TARGET_OLD_SPRITE)
 		 {
-	   	  for(z=0;z<8;z++) tiles[(tile_y*tiles_y+tile_x)*1024+y*32+(x/4)*4+(7-z)/2]|=((((get_tile_el_value(x,y)&(1<<(z%8))))>>(z%8))<<(3-(x%4)))<<((1-(z%2))*4);
+	   	  for(z=0;z<8;z++) tiles[(ty*tiles_x+tx)*tile_bytes+y*32+(x/4)*4+(7-z)/2]|=((((get_tile_el_value(x,y)&(1<<(z%8))))>>(z%8))<<(3-(x%4)))<<((1-(z%2))*4);
 		 }
 		 else fputc(get_tile_el_value(x/4+(3-(x%4)),y),tilefile1);
         }
@@ -669,13 +1010,13 @@ int main(int argc,char *argv[])
       {
        if(sourceFormat==FORMAT_HALF_DEPTH)
        {
-        pix0=get_tile_el_value(z,y);
-        if(tx<tiles_x/2)	pix0>>4;
+        pix0=get_tile_el_value(x,y);
+        if(tile_x<src_tiles_x/2)	pix0>>4; //no-op on purpose, see above
         else				pix0&=0xf;
        }
        for(z=0;z<tile_depth;z++)
        {
-        if(targetFormat==TARGET_NEOGEO_SPR) tiles[tiles_x*128+(x/8)*64+y*16+z]|=(((get_tile_el_value((x/8)*4+z,y))&(1<<(7-(x%8))))>>(7-(x%8)))<<(x%8);
+        if(targetFormat==TARGET_NEOGEO_SPR) tiles[(ty*tiles_x+tx)*tile_bytes+(1-x/8)*64+(y/8)*32+(y%8)*4+z]|=(((get_tile_el_value((x/8)*4+z,y))&(1<<(7-(x%8))))>>(7-(x%8)))<<(x%8);
         else
         {
          pix1=get_tile_el_value(z,y);
@@ -704,8 +1045,8 @@ int main(int argc,char *argv[])
  }
  if(targetFormat==TARGET_OLD_SPRITE||targetFormat==TARGET_NEOGEO_SPR)
  {
-  long i;
-  for(i=0;i<sourceFormat<FORMAT_ROHGA_DECR?img_width*img_height:tile_size*tile_size*depth/8;i++)
+  size_t i;
+  for(i=0;i<staged_size;i++)
   {
    if(targetFormat!=TARGET_NEOGEO_SPR||(targetFormat==TARGET_NEOGEO_SPR&&i%4<2))	fputc(tiles[i],tilefile1);
    else if(targetFormat==TARGET_NEOGEO_SPR&&i%4>=2)									fputc(tiles[i],tilefile2);
@@ -738,4 +1079,5 @@ int main(int argc,char *argv[])
  if(targetFormat==TARGET_NEOGEO_SPR)	fclose(tilefile2);
  if(isTileMap)							fclose(tilemapfile);
  if(palfile)							fclose(palfile);
+ free(arena.base);
 }
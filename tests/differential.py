@@ -0,0 +1,350 @@
+#!/usr/bin/env python3
+"""
+Differential check of the converter fast paths.
+
+Full conversions are the reference: every -rect/-tiles conversion of a
+random source has to give exactly the tiles, tilemap entries and palette
+of the same region of the full one. Linear BMP targets are also checked
+against an independent encoder written here. Finally, partial conversions
+of a large source have to be at least --min-speedup times faster than
+the full ones.
+"""
+
+import argparse
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+#name: (pixel depth, tile size, tile size with -full or None, tilemap allowed, -ref allowed)
+BMP_TARGETS = {
+    "c123": (8, 8, None, True, False),
+    "old_sprite": (8, 16, 32, False, False),
+    "model3_8": (8, 8, None, True, False),
+    "psikyo_later_generations_8": (8, 16, None, True, False),
+    "atetris": (4, 8, None, True, False),
+    "tc0180vcu": (4, 8, 16, True, True),
+}
+
+#(source, target, -full allowed, -tm allowed, -ref allowed)
+RAW_PAIRS = [
+    ("rohga_decr", "model3_8", False, False, False),
+    ("pce_cg", "model3_8", False, False, False),
+    ("planar4_16x16", "model3_8", False, True, False),
+    ("old_sprite", "model3_8", False, True, False),
+    ("taito_z", "model3_8", False, True, True),
+    ("underfire", "model3_8", False, True, False),
+    ("half_depth", "model3_8", False, True, False),
+    ("planar4_16x16", "neogeo_spr", True, False, False),
+    ("neo_mirror", "neogeo_spr", False, False, False),
+    ("taito_z", "neogeo_spr", False, False, True),
+]
+
+RAW_DEPTH = {"old_sprite": 8, "underfire": 5}
+
+
+class Failure(Exception):
+    pass
+
+
+def write_bmp(path, width, height, depth, rng, colours=None):
+    colours = colours or (1 << depth)
+    palette = b"".join(bytes((rng.randrange(256), rng.randrange(256), rng.randrange(256), 0)) for _ in range(1 << depth))
+    #A small set of repeated tiles makes the duplicates search do some work
+    row_bytes = width * depth // 8
+    motifs = [bytes(rng.randrange(256) for _ in range(64)) for _ in range(4)]
+    pixels = bytearray()
+    for y in range(height):
+        for x in range(row_bytes):
+            if rng.random() < 0.5:
+                value = motifs[(x // 8 + y // 8) % 4][(y % 8) * 8 + x % 8]
+            else:
+                value = rng.randrange(256)
+            if depth == 8:
+                value %= colours
+            pixels.append(value)
+    write_bmp_data(path, width, height, depth, palette, bytes(pixels))
+
+
+def write_bmp_data(path, width, height, depth, palette, pixels):
+    offset = 54 + len(palette)
+    header = b"BM" + struct.pack("<IHHI", offset + len(pixels), 0, 0, offset)
+    header += struct.pack("<IiiHHIIiiII", 40, width, height, 1, depth, 0, len(pixels), 0, 0, 1 << depth, 0)
+    with open(path, "wb") as f:
+        f.write(header + palette + pixels)
+
+
+def run(binary, workdir, name, args):
+    #The converter names its outputs after the source, so every run gets a clean directory
+    if os.path.isdir(workdir):
+        shutil.rmtree(workdir)
+    os.makedirs(workdir)
+    source = os.path.join(workdir, os.path.basename(name))
+    shutil.copyfile(name, source)
+    result = subprocess.run([binary, source] + args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    if result.returncode != 0:
+        raise Failure("%s %s failed: %s" % (os.path.basename(name), " ".join(args), result.stdout.decode(errors="replace").strip()))
+    outputs = {}
+    stem = os.path.splitext(os.path.basename(name))[0]
+    for suffix in (".bin", ".c1", ".c2", "_tilemap.bin", "_pal.bin"):
+        path = os.path.join(workdir, stem + suffix)
+        if os.path.exists(path):
+            with open(path, "rb") as f:
+                outputs[suffix] = f.read()
+    return outputs
+
+
+def split_tiles(outputs, tiles_num, tilemap, banked):
+    """Returns the data of every tile of the region (and its palette bank)"""
+    if tilemap:
+        entries = [struct.unpack(">I", outputs["_tilemap.bin"][i * 4:i * 4 + 4])[0] for i in range(tiles_num)]
+        indices = [e & 0xFFFFFF if banked else e for e in entries]
+        banks = [e >> 24 if banked else 0 for e in entries]
+        unique_num = max(indices) + 1
+    else:
+        indices = list(range(tiles_num))
+        banks = [0] * tiles_num
+        unique_num = tiles_num
+    streams = [outputs[s] for s in (".bin", ".c1", ".c2") if s in outputs]
+    for data in streams:
+        if len(data) % unique_num:
+            raise Failure("output size %d isn't a multiple of %d tiles" % (len(data), unique_num))
+    result = []
+    for index, bank in zip(indices, banks):
+        tile = b"".join(data[index * (len(data) // unique_num):(index + 1) * (len(data) // unique_num)] for data in streams)
+        result.append((tile, bank))
+    return result
+
+
+def compare_region(full, part, full_tiles, region, tilemap, banked, label):
+    full_split = split_tiles(full, len(full_tiles), tilemap, banked)
+    part_split = split_tiles(part, len(region), tilemap, banked)
+    for i, tile in enumerate(region):
+        if part_split[i] != full_split[full_tiles.index(tile)]:
+            raise Failure("%s: tile %s differs from the full conversion" % (label, tile))
+    if full.get("_pal.bin") != part.get("_pal.bin"):
+        raise Failure("%s: palette differs from the full conversion" % label)
+
+
+def reference_linear(path, tile_size, tilemap):
+    """Independent encoder of the linear BMP targets (c123, psikyo_later_generations_8, atetris)"""
+    with open(path, "rb") as f:
+        data = f.read()
+    width, height = struct.unpack("<ii", data[18:26])
+    depth = data[28]
+    row_bytes = width * depth // 8
+    pixels = data[len(data) - row_bytes * height:]
+    rows = [pixels[(height - 1 - y) * row_bytes:(height - y) * row_bytes] for y in range(height)]
+    tile_row = tile_size * depth // 8
+    tiles = []
+    for ty in range(height // tile_size):
+        for tx in range(width // tile_size):
+            tiles.append(b"".join(rows[ty * tile_size + y][tx * tile_row:(tx + 1) * tile_row] for y in range(tile_size)))
+    out = {}
+    if tilemap:
+        unique = []
+        entries = bytearray()
+        for tile in tiles:
+            if tile not in unique:
+                unique.append(tile)
+            entries += struct.pack(">I", unique.index(tile))
+        out["_tilemap.bin"] = bytes(entries)
+        tiles = unique
+    out[".bin"] = b"".join(tiles)
+    palette = data[54:54 + (4 << depth)]
+    if depth == 8:
+        out["_pal.bin"] = b"".join(bytes((palette[i + 2], palette[i + 1], palette[i])) for i in range(0, len(palette), 4))
+    else:
+        out["_pal.bin"] = bytes(((palette[i + 2] >> 5) << 5) | ((palette[i + 1] >> 5) << 2) | (palette[i] >> 6) for i in range(0, len(palette), 4))
+    return out
+
+
+def check_bmp(binary, tmp, rng, target, iteration):
+    depth, tile_size, full_tile_size, tilemap_allowed, ref_allowed = BMP_TARGETS[target]
+    args = ["-out", target]
+    if full_tile_size and rng.random() < 0.5:
+        args.append("-full")
+        tile_size = full_tile_size
+    #8bpp images are split to palette banks for 4bpp targets, that needs a tilemap
+    banked = depth == 4 and rng.random() < 0.4
+    tilemap = banked or (tilemap_allowed and rng.random() < 0.6)
+    if tilemap:
+        args.append("-tm")
+    if ref_allowed and rng.random() < 0.5:
+        args.append("-ref")
+    tiles_x, tiles_y = rng.randint(1, 8), rng.randint(1, 6)
+    source = os.path.join(tmp, "sheet%d.bmp" % iteration)
+    write_bmp(source, tiles_x * tile_size, tiles_y * tile_size, 8 if banked else depth, rng, 48 if banked else None)
+
+    full = run(binary, os.path.join(tmp, "full"), source, args)
+    label = "%s %s" % (target, " ".join(args[2:]))
+
+    if target in ("c123", "psikyo_later_generations_8", "atetris") and not banked:
+        expected = reference_linear(source, tile_size, tilemap)
+        for suffix, data in expected.items():
+            if full.get(suffix) != data:
+                raise Failure("%s: %s differs from the reference encoder" % (label, suffix))
+
+    x0, y0 = rng.randrange(tiles_x), rng.randrange(tiles_y)
+    w, h = rng.randint(1, tiles_x - x0), rng.randint(1, tiles_y - y0)
+    rect = "%d,%d,%d,%d" % (x0 * tile_size, y0 * tile_size, w * tile_size, h * tile_size)
+    part = run(binary, os.path.join(tmp, "part"), source, args + ["-rect", rect])
+
+    full_tiles = [(x, y) for y in range(tiles_y) for x in range(tiles_x)]
+    region = [(x, y) for y in range(y0, y0 + h) for x in range(x0, x0 + w)]
+    compare_region(full, part, full_tiles, region, tilemap, banked, "%s -rect %s" % (label, rect))
+
+
+def check_sub_palettes(binary, tmp, rng, target, iteration):
+    """An 8bpp image with a single palette bank per tile has to give the tiles of the same 4bpp image"""
+    _, tile_size, full_tile_size, _, ref_allowed = BMP_TARGETS[target]
+    args = ["-out", target, "-tm"]
+    if full_tile_size and rng.random() < 0.5:
+        args.append("-full")
+        tile_size = full_tile_size
+    if ref_allowed and rng.random() < 0.5:
+        args.append("-ref")
+    tiles_x, tiles_y = rng.randint(1, 6), rng.randint(1, 4)
+    width, height = tiles_x * tile_size, tiles_y * tile_size
+    banks = [rng.randrange(16) for _ in range(tiles_x * tiles_y)]
+    nibbles = [[rng.randrange(16) for _ in range(width)] for _ in range(height)]
+    #Distinct colours keep the own bank of a tile the only exact one
+    colours = rng.sample(range(1 << 24), 256)
+    palette8 = b"".join(struct.pack("<I", c) for c in colours)
+    rows4, rows8 = [], []
+    for y in range(height):
+        row = nibbles[y]
+        rows4.append(bytes((row[x] << 4) | row[x + 1] for x in range(0, width, 2)))
+        rows8.append(bytes(banks[(y // tile_size) * tiles_x + x // tile_size] * 16 + row[x] for x in range(width)))
+    source4 = os.path.join(tmp, "nibbles%d.bmp" % iteration)
+    source8 = os.path.join(tmp, "banked%d.bmp" % iteration)
+    write_bmp_data(source4, width, height, 4, palette8[:64], b"".join(reversed(rows4)))
+    write_bmp_data(source8, width, height, 8, palette8, b"".join(reversed(rows8)))
+
+    label = "%s %s 8bpp" % (target, " ".join(args[2:]))
+    out4 = run(binary, os.path.join(tmp, "full"), source4, args)
+    out8 = run(binary, os.path.join(tmp, "part"), source8, args)
+    if out8[".bin"] != out4[".bin"]:
+        raise Failure("%s: tiles (%d bytes) differ from the 4bpp ones (%d bytes)" % (label, len(out8[".bin"]), len(out4[".bin"])))
+    expected = bytearray(out4["_tilemap.bin"])
+    for i, bank in enumerate(banks):
+        expected[i * 4] = bank
+    if out8["_tilemap.bin"] != bytes(expected):
+        raise Failure("%s: tilemap doesn't hold the tile banks" % label)
+
+
+def check_raw(binary, tmp, rng, pair, iteration):
+    source_format, target, full_allowed, tilemap_allowed, ref_allowed = pair
+    args = ["-in", source_format, "-out", target]
+    tile_size = 16 if target == "neogeo_spr" else 8
+    if full_allowed and rng.random() < 0.5:
+        args.append("-full")
+    tilemap = tilemap_allowed and rng.random() < 0.6
+    if tilemap:
+        args.append("-tm")
+    if ref_allowed and rng.random() < 0.5:
+        args.append("-ref")
+    tile_bytes = tile_size * (8 if source_format == "taito_z" else tile_size) * RAW_DEPTH.get(source_format, 4) // 8
+    #Whole 1024-byte blocks keep every grouped tile layout complete
+    size = 1024 * rng.randint(1, 8)
+    tiles_num = size // tile_bytes
+    source = os.path.join(tmp, "rom%d.dat" % iteration)
+    motifs = [bytes(rng.randrange(256) for _ in range(tile_bytes)) for _ in range(3)]
+    with open(source, "wb") as f:
+        f.write(b"".join(motifs[rng.randrange(3)] if rng.random() < 0.5 else bytes(rng.randrange(256) for _ in range(tile_bytes)) for _ in range(size // tile_bytes)))
+
+    full = run(binary, os.path.join(tmp, "full"), source, args)
+    start = rng.randrange(tiles_num)
+    count = rng.randint(1, tiles_num - start)
+    part = run(binary, os.path.join(tmp, "part"), source, args + ["-tiles", "%d,%d" % (start, count)])
+    label = "%s %s -tiles %d,%d" % (source_format, " ".join(args[2:]), start, count)
+    compare_region(full, part, list(range(tiles_num)), list(range(start, start + count)), tilemap, False, label)
+
+
+def best_time(binary, tmp, source, args, runs):
+    best = None
+    for _ in range(runs):
+        started = time.perf_counter()
+        run(binary, os.path.join(tmp, "timing"), source, args)
+        elapsed = time.perf_counter() - started
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def check_throughput(binary, tmp, rng, min_speedup):
+    """A sixteenth of a large source should convert at least min_speedup times faster than all of it"""
+    sheet = os.path.join(tmp, "large.bmp")
+    write_bmp(sheet, 1024, 1024, 8, rng)
+    rom = os.path.join(tmp, "large.dat")
+    with open(rom, "wb") as f:
+        f.write(os.urandom(4 << 20))
+
+    cases = [
+        (sheet, ["-out", "c123"], ["-rect", "256,256,256,256"]),
+        (rom, ["-in", "neo_mirror", "-out", "neogeo_spr"], ["-tiles", "%d,%d" % (8192, 2048)]),
+    ]
+    for source, args, region in cases:
+        full = best_time(binary, tmp, source, args, 3)
+        part = best_time(binary, tmp, source, args + region, 3)
+        speedup = full / part
+        print("throughput %s %s: full %.1f ms, partial %.1f ms, x%.1f" % (os.path.basename(source), " ".join(region), full * 1000, part * 1000, speedup))
+        if speedup < min_speedup:
+            raise Failure("%s %s is only x%.2f faster than the full conversion (x%.2f required)" % (os.path.basename(source), " ".join(region), speedup, min_speedup))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("binary")
+    parser.add_argument("--seed", type=int, default=int(os.environ.get("BBLB_SEED", "1")))
+    parser.add_argument("--iterations", type=int, default=4, help="random sources per format combination")
+    parser.add_argument("--min-speedup", type=float, default=2.0, help="0 disables the throughput gate")
+    options = parser.parse_args()
+
+    binary = os.path.abspath(options.binary)
+    rng = random.Random(options.seed)
+    tmp = tempfile.mkdtemp(prefix="bblb_diff_")
+    failures = 0
+    checks = 0
+    try:
+        for iteration in range(options.iterations):
+            for target in BMP_TARGETS:
+                checks += 1
+                try:
+                    check_bmp(binary, tmp, rng, target, iteration)
+                except Failure as e:
+                    failures += 1
+                    print("FAIL:", e)
+            for target in ("atetris", "tc0180vcu"):
+                checks += 1
+                try:
+                    check_sub_palettes(binary, tmp, rng, target, iteration)
+                except Failure as e:
+                    failures += 1
+                    print("FAIL:", e)
+            for pair in RAW_PAIRS:
+                checks += 1
+                try:
+                    check_raw(binary, tmp, rng, pair, iteration)
+                except Failure as e:
+                    failures += 1
+                    print("FAIL:", e)
+        if options.min_speedup > 0:
+            checks += 1
+            try:
+                check_throughput(binary, tmp, rng, options.min_speedup)
+            except Failure as e:
+                failures += 1
+                print("FAIL:", e)
+    finally:
+        shutil.rmtree(tmp, ignore_errors=True)
+
+    print("%d of %d checks passed (seed %d)" % (checks - failures, checks, options.seed))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())